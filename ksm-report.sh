@@ -0,0 +1,74 @@
+#!/bin/sh
+
+usage()
+{
+    ME=$(basename $0)
+    cat <<EOM 1>&2
+usage: ${ME} [ PID... ]
+
+Report shared versus private memory for QEMU/KVM unikernels, along with the
+host KSM counters. If no PIDs are given, all running qemu-system-x86_64
+processes are reported.
+EOM
+    exit 1
+}
+
+# Convert a page count to KiB.
+pages_kb()
+{
+    echo $(( $1 * ${PAGE_KB} ))
+}
+
+case $1 in
+    -h|--help)
+        usage
+        ;;
+esac
+
+PAGE_KB=$(( $(getconf PAGESIZE) / 1024 ))
+KSM=/sys/kernel/mm/ksm
+
+PIDS="$@"
+[ -z "${PIDS}" ] && PIDS=$(pgrep -f qemu-system-x86_64)
+if [ -z "${PIDS}" ]; then
+    echo error: No qemu-system-x86_64 processes found. 1>&2
+    exit 1
+fi
+
+printf "%8s %10s %10s %10s %10s %10s\n" \
+    PID RSS_KB PSS_KB SHARED_KB PRIVATE_KB KSM_KB
+for PID in ${PIDS}; do
+    SMAPS=/proc/${PID}/smaps_rollup
+    if [ ! -r ${SMAPS} ]; then
+        echo warning: Cannot read ${SMAPS}, skipping. 1>&2
+        continue
+    fi
+    # ksm_merging_pages is only available on newer kernels.
+    KSM_PAGES=$(awk '/^ksm_merging_pages/{print $2}' \
+        /proc/${PID}/ksm_stat 2>/dev/null)
+    awk -v pid=${PID} -v ksm_kb=$(pages_kb ${KSM_PAGES:-0}) '
+        /^Rss:/ { rss = $2 }
+        /^Pss:/ { pss = $2 }
+        /^Shared_(Clean|Dirty):/ { shared += $2 }
+        /^Private_(Clean|Dirty):/ { private += $2 }
+        END {
+            printf "%8d %10d %10d %10d %10d %10d\n",
+                pid, rss, pss, shared, private, ksm_kb
+        }' ${SMAPS}
+done
+
+if [ ! -r ${KSM}/run ]; then
+    echo warning: KSM not available on this host. 1>&2
+    exit 0
+fi
+echo
+if [ "$(cat ${KSM}/run)" != "1" ]; then
+    cat <<EOM 1>&2
+>>> WARNING: KSM is not running, guest memory will not be merged.
+>>> WARNING: Run "echo 1 > ${KSM}/run" to enable it.
+EOM
+fi
+echo "KSM pages_shared:   $(pages_kb $(cat ${KSM}/pages_shared)) KiB"
+echo "KSM pages_sharing:  $(pages_kb $(cat ${KSM}/pages_sharing)) KiB (saved)"
+echo "KSM pages_unshared: $(pages_kb $(cat ${KSM}/pages_unshared)) KiB"
+echo "KSM full_scans:     $(cat ${KSM}/full_scans)"
@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2016 Martin Lucina <martin.lucina@docker.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "capture.h"
+
+/* Ring geometry: 8 blocks of 256kB, blocks retired after 100ms */
+#define RING_BLOCK_SIZE (256 * 1024)
+#define RING_BLOCK_NR   8
+#define RING_FRAME_SIZE 2048
+#define RING_BLOCK_TOV  100
+
+/* Name of the capture file, rotated to CAPTURE_FILE.1 */
+#define CAPTURE_FILE    "capture.pcap"
+
+/* Defaults, if not configured */
+#define DEFAULT_SNAPLEN 128
+#define DEFAULT_SIZE_MB 16
+
+/* Classic libpcap file format */
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+/*
+ * Parse a classic BPF program in the format output by "tcpdump -ddd", with
+ * newlines replaced by commas: "N,code jt jf k,...". Returns 0 if
+ * successful.
+ */
+static int parse_filter(struct capture *c, const char *s)
+{
+    char *end;
+    unsigned long n = strtoul(s, &end, 10);
+
+    if (end == s || *end != ',' || n == 0 || n > BPF_MAXINSNS)
+        return 1;
+    c->filter = calloc(n, sizeof *c->filter);
+    assert(c->filter);
+    c->filter_len = n;
+
+    for (unsigned long i = 0; i < n; i++) {
+        unsigned int code, jt, jf;
+        unsigned long k;
+        int len;
+
+        s = end + 1;
+        if (sscanf(s, "%u %u %u %lu%n", &code, &jt, &jf, &k, &len) != 4)
+            return 1;
+        end = (char *)s + len;
+        if (*end != (i == n - 1 ? '\0' : ','))
+            return 1;
+        c->filter[i].code = code;
+        c->filter[i].jt = jt;
+        c->filter[i].jf = jf;
+        c->filter[i].k = k;
+    }
+
+    return 0;
+}
+
+int capture_configure(struct capture *c)
+{
+    char *s, *end;
+
+    memset(c, 0, sizeof *c);
+    c->fd = -1;
+    c->out_fd = -1;
+
+    /*
+     * RUNNER_CAPTURE: Directory to write capture files to.
+     */
+    s = getenv("RUNNER_CAPTURE");
+    if (s == NULL || *s == '\0')
+        return 0;
+    c->dir = s;
+    int rc = asprintf(&c->out_path, "%s/%s", c->dir, CAPTURE_FILE);
+    assert(rc != -1);
+
+    c->max_bytes = (size_t)DEFAULT_SIZE_MB << 20;
+    s = getenv("RUNNER_CAPTURE_SIZE");
+    if (s && *s) {
+        unsigned long mb = strtoul(s, &end, 10);
+        if (*end != '\0' || mb == 0) {
+            warnx("error: Invalid RUNNER_CAPTURE_SIZE: %s", s);
+            return 1;
+        }
+        c->max_bytes = (size_t)mb << 20;
+    }
+
+    c->snaplen = DEFAULT_SNAPLEN;
+    s = getenv("RUNNER_CAPTURE_SNAPLEN");
+    if (s && *s) {
+        unsigned long snaplen = strtoul(s, &end, 10);
+        if (*end != '\0' || snaplen < ETH_HLEN || snaplen > 65535) {
+            warnx("error: Invalid RUNNER_CAPTURE_SNAPLEN: %s", s);
+            return 1;
+        }
+        c->snaplen = snaplen;
+    }
+
+    s = getenv("RUNNER_CAPTURE_FILTER");
+    if (s && *s) {
+        if (parse_filter(c, s) != 0) {
+            warnx("error: Invalid RUNNER_CAPTURE_FILTER");
+            return 1;
+        }
+    }
+    else {
+        /* Accept everything */
+        c->filter = calloc(1, sizeof *c->filter);
+        assert(c->filter);
+        c->filter_len = 1;
+        c->filter[0].code = BPF_RET | BPF_K;
+        c->filter[0].k = 0xffffffff;
+    }
+    /*
+     * The filter's return value is the number of bytes to keep, so apply
+     * the snaplen there and the kernel only copies what we want to the
+     * ring. This only works for constant return values.
+     */
+    for (unsigned int i = 0; i < c->filter_len; i++) {
+        if (BPF_CLASS(c->filter[i].code) != BPF_RET)
+            continue;
+        if (BPF_RVAL(c->filter[i].code) != BPF_K) {
+            warnx("error: Invalid RUNNER_CAPTURE_FILTER: "
+                    "Only constant return values are supported");
+            return 1;
+        }
+        if (c->filter[i].k > c->snaplen)
+            c->filter[i].k = c->snaplen;
+    }
+
+    return 0;
+}
+
+int capture_open(struct capture *c, int ifindex)
+{
+    int fd, v;
+
+    if (c->dir == NULL)
+        return 0;
+
+    /*
+     * Don't bind to a protocol until the filter and ring are set up,
+     * otherwise we'd see traffic on all interfaces in the meantime.
+     */
+    fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        warn("error: Could not create capture socket");
+        return 1;
+    }
+    struct sock_fprog prog = { .len = c->filter_len, .filter = c->filter };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+                sizeof prog) == -1) {
+        warn("error: Could not attach capture filter");
+        goto fail;
+    }
+    v = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &v, sizeof v) == -1) {
+        warn("error: TPACKET_V3 not supported");
+        goto fail;
+    }
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof req);
+    req.tp_block_size = RING_BLOCK_SIZE;
+    req.tp_block_nr = RING_BLOCK_NR;
+    req.tp_frame_size = RING_FRAME_SIZE;
+    req.tp_frame_nr = (RING_BLOCK_SIZE * RING_BLOCK_NR) / RING_FRAME_SIZE;
+    req.tp_retire_blk_tov = RING_BLOCK_TOV;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof req) == -1) {
+        warn("error: Could not set up capture ring");
+        goto fail;
+    }
+    c->block_size = RING_BLOCK_SIZE;
+    c->block_nr = RING_BLOCK_NR;
+    c->ring = mmap(NULL, c->block_size * c->block_nr, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if (c->ring == MAP_FAILED) {
+        warn("error: Could not map capture ring");
+        c->ring = NULL;
+        goto fail;
+    }
+
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof sll);
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&sll, sizeof sll) == -1) {
+        warn("error: Could not bind capture socket");
+        goto fail;
+    }
+
+    c->fd = fd;
+    return 0;
+
+fail:
+    if (c->ring)
+        munmap(c->ring, c->block_size * c->block_nr);
+    c->ring = NULL;
+    close(fd);
+    return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Start a new capture file, keeping the previous one as CAPTURE_FILE.1, so
+ * that at most max_bytes are kept on disk.
+ */
+static int rotate(struct capture *c)
+{
+    if (c->out_fd != -1) {
+        char *old_path;
+        int rc = asprintf(&old_path, "%s.1", c->out_path);
+        assert(rc != -1);
+        close(c->out_fd);
+        if (rename(c->out_path, old_path) == -1)
+            warn("capture: Could not rename %s", c->out_path);
+        free(old_path);
+
+        struct tpacket_stats_v3 st;
+        socklen_t st_len = sizeof st;
+        if (getsockopt(c->fd, SOL_PACKET, PACKET_STATISTICS, &st,
+                    &st_len) == 0 && st.tp_drops)
+            warnx("capture: %u packets dropped", st.tp_drops);
+    }
+
+    c->out_fd = open(c->out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0644);
+    if (c->out_fd == -1) {
+        warn("capture: Could not create %s", c->out_path);
+        return 1;
+    }
+    struct pcap_file_hdr hdr = {
+        .magic = 0xa1b2c3d4,
+        .version_major = 2,
+        .version_minor = 4,
+        .snaplen = c->snaplen,
+        .linktype = 1 /* LINKTYPE_ETHERNET */
+    };
+    if (write_all(c->out_fd, &hdr, sizeof hdr) != 0) {
+        warn("capture: Could not write %s", c->out_path);
+        return 1;
+    }
+    c->out_bytes = sizeof hdr;
+    return 0;
+}
+
+/*
+ * Write all frames in the block to the capture file.
+ */
+static int write_block(struct capture *c, struct tpacket_block_desc *bd)
+{
+    struct tpacket3_hdr *ppd = (struct tpacket3_hdr *)
+        ((unsigned char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+
+    for (unsigned int i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+        if (c->out_fd == -1 || c->out_bytes >= c->max_bytes / 2) {
+            if (rotate(c) != 0)
+                return 1;
+        }
+
+        struct pcap_rec_hdr rec = {
+            .ts_sec = ppd->tp_sec,
+            .ts_usec = ppd->tp_nsec / 1000,
+            .incl_len = ppd->tp_snaplen,
+            .orig_len = ppd->tp_len
+        };
+        if (write_all(c->out_fd, &rec, sizeof rec) != 0 ||
+                write_all(c->out_fd, (unsigned char *)ppd + ppd->tp_mac,
+                    ppd->tp_snaplen) != 0) {
+            warn("capture: Could not write %s", c->out_path);
+            return 1;
+        }
+        c->out_bytes += sizeof rec + ppd->tp_snaplen;
+
+        ppd = (struct tpacket3_hdr *)((unsigned char *)ppd +
+                ppd->tp_next_offset);
+    }
+    return 0;
+}
+
+int capture_start(struct capture *c)
+{
+    if (c->fd == -1)
+        return 0;
+    if (rotate(c) != 0) {
+        warnx("error: Could not start capture in %s", c->dir);
+        return 1;
+    }
+    return 0;
+}
+
+int capture_drain(struct capture *c)
+{
+    for (;;) {
+        struct tpacket_block_desc *bd = (struct tpacket_block_desc *)
+            (c->ring + c->block_cur * c->block_size);
+
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+                    & TP_STATUS_USER))
+            return 0;
+
+        int rc = write_block(c, bd);
+        /* Hand the block back to the kernel even if we failed */
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                __ATOMIC_RELEASE);
+        c->block_cur = (c->block_cur + 1) % c->block_nr;
+        if (rc != 0)
+            return 1;
+    }
+}
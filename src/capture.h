@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2016 Martin Lucina <martin.lucina@docker.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef RUNNER_CAPTURE_H
+#define RUNNER_CAPTURE_H
+
+#include <stddef.h>
+#include <linux/filter.h>
+
+/*
+ * Packet capture on the guest tap interface, using a TPACKET_V3 mmap()ed
+ * ring. The kernel drops frames when the ring is full, so capture never
+ * slows down the guest.
+ */
+struct capture {
+    /* Configuration, see capture_configure() */
+    char *dir;
+    size_t max_bytes;
+    unsigned int snaplen;
+    struct sock_filter *filter;
+    unsigned short filter_len;
+
+    /* Runtime state */
+    int fd;
+    unsigned char *ring;
+    size_t block_size;
+    unsigned int block_nr;
+    unsigned int block_cur;
+    int out_fd;
+    char *out_path;
+    size_t out_bytes;
+};
+
+/*
+ * Initialise *c from RUNNER_CAPTURE* environment variables. Returns 0 if
+ * successful, 1 if the configuration is invalid.
+ */
+int capture_configure(struct capture *c);
+
+/*
+ * Open the capture ring on the interface 'ifindex'. Must be called before
+ * capabilities are dropped. Returns 0 if successful, 1 if not.
+ */
+int capture_open(struct capture *c, int ifindex);
+
+/*
+ * Create the first capture file. Call after capabilities are dropped, so
+ * that a capture directory the monitor cannot write to is caught at
+ * startup. Returns 0 if successful, 1 if not.
+ */
+int capture_start(struct capture *c);
+
+/*
+ * Write out all blocks the kernel has handed over to us. Returns 0 if
+ * successful, 1 if a fatal error occured and capture should stop.
+ */
+int capture_drain(struct capture *c);
+
+#endif
@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2016 Martin Lucina <martin.lucina@docker.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "monitor.h"
+
+/* How often to check the tap interface statistics, in ms */
+#define IDLE_TICK_MS    1000
+/* How long to wait for a QMP response, in ms */
+#define QMP_TIMEOUT_MS  5000
+
+/* Socket filter used while the guest is running: drop everything */
+static struct sock_filter filter_drop[] = {
+    BPF_STMT(BPF_RET | BPF_K, 0)
+};
+
+/* Socket filter used while the guest is paused: frames towards the guest */
+static struct sock_filter filter_to_guest[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 1),
+    BPF_STMT(BPF_RET | BPF_K, 0)
+};
+
+static int set_filter(int fd, struct sock_filter *filter, unsigned short len)
+{
+    struct sock_fprog prog = { .len = len, .filter = filter };
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof prog);
+}
+
+int idle_configure(struct idle *d)
+{
+    char *s, *end;
+
+    memset(d, 0, sizeof *d);
+    d->fd = -1;
+    d->rx_fd = -1;
+    d->tx_fd = -1;
+    d->qmp_fd = -1;
+
+    /*
+     * RUNNER_IDLE: Seconds without traffic before the guest is paused.
+     */
+    s = getenv("RUNNER_IDLE");
+    if (s == NULL || *s == '\0')
+        return 0;
+    unsigned long timeout = strtoul(s, &end, 10);
+    if (*end != '\0' || timeout == 0 || timeout > 86400) {
+        warnx("error: Invalid RUNNER_IDLE: %s", s);
+        return 1;
+    }
+    d->timeout = timeout;
+
+    s = getenv("RUNNER_IDLE_RECLAIM");
+    if (s && strcmp(s, "1") == 0)
+        d->reclaim = 1;
+
+    return 0;
+}
+
+int idle_open(struct idle *d, const char *ifname, int ifindex)
+{
+    char path[64];
+    int fd;
+
+    if (d->timeout == 0)
+        return 0;
+
+    /*
+     * Guests not run by QEMU are paused using SIGSTOP. The hypervisor
+     * inherits our PID, and the kernel ignores SIGSTOP sent to PID 1 from
+     * inside its PID namespace.
+     */
+    if (d->qmp_path == NULL && getpid() == 1) {
+        warnx("error: RUNNER_IDLE requires the qemu or kvm hypervisor, "
+                "or running with 'docker run --init'");
+        return 1;
+    }
+
+    /*
+     * Interface statistics are used to detect idleness, so that we do not
+     * have to look at every frame while the guest is running.
+     */
+    snprintf(path, sizeof path, "/sys/class/net/%s/statistics/rx_packets",
+            ifname);
+    d->rx_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (d->rx_fd == -1) {
+        warn("error: Could not open %s", path);
+        return 1;
+    }
+    snprintf(path, sizeof path, "/sys/class/net/%s/statistics/tx_packets",
+            ifname);
+    d->tx_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (d->tx_fd == -1) {
+        warn("error: Could not open %s", path);
+        return 1;
+    }
+
+    /*
+     * The wakeup socket. Don't bind to a protocol until the filter is
+     * attached.
+     */
+    fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        warn("error: Could not create packet socket");
+        return 1;
+    }
+    if (set_filter(fd, filter_drop,
+                sizeof filter_drop / sizeof filter_drop[0]) == -1) {
+        warn("error: Could not attach socket filter");
+        close(fd);
+        return 1;
+    }
+    /*
+     * Frames are only timestamped if someone asked for it when they arrive,
+     * so ask now rather than in idle_wake().
+     */
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof one) == -1) {
+        warn("error: Could not enable timestamps on packet socket");
+        close(fd);
+        return 1;
+    }
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof sll);
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&sll, sizeof sll) == -1) {
+        warn("error: Could not bind packet socket");
+        close(fd);
+        return 1;
+    }
+    d->fd = fd;
+
+    return 0;
+}
+
+static uint64_t read_counter(int fd)
+{
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof buf - 1, 0);
+
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    return strtoull(buf, NULL, 10);
+}
+
+/*
+ * Wait for a line from QMP containing 'token'. Returns 0 if found, 1 on
+ * error, timeout or if QMP returned an error.
+ */
+static int qmp_wait(int fd, const char *token)
+{
+    char buf[4096];
+    size_t len = 0;
+
+    for (;;) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int rc = poll(&pfd, 1, QMP_TIMEOUT_MS);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return 1;
+        ssize_t n = read(fd, buf + len, sizeof buf - 1 - len);
+        if (n <= 0)
+            return 1;
+        len += n;
+        buf[len] = '\0';
+
+        /* Look at complete lines only; events may arrive at any time */
+        char *line = buf, *nl;
+        while ((nl = strchr(line, '\n')) != NULL) {
+            *nl = '\0';
+            if (strstr(line, token))
+                return 0;
+            if (strstr(line, "\"error\"")) {
+                warnx("idle: QMP error: %s", line);
+                return 1;
+            }
+            line = nl + 1;
+        }
+        len = strlen(line);
+        memmove(buf, line, len);
+        if (len == sizeof buf - 1)
+            len = 0;
+    }
+}
+
+static int qmp_execute(struct idle *d, const char *command)
+{
+    char msg[64];
+
+    if (d->qmp_fd == -1) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof sun);
+        sun.sun_family = AF_UNIX;
+        strncpy(sun.sun_path, d->qmp_path, sizeof sun.sun_path - 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            warn("idle: Could not create QMP socket");
+            return 1;
+        }
+        if (connect(fd, (struct sockaddr *)&sun, sizeof sun) == -1) {
+            warn("idle: Could not connect to QMP at %s", d->qmp_path);
+            close(fd);
+            return 1;
+        }
+        const char *caps = "{\"execute\":\"qmp_capabilities\"}\n";
+        if (qmp_wait(fd, "\"QMP\"") != 0 ||
+                write(fd, caps, strlen(caps)) != (ssize_t)strlen(caps) ||
+                qmp_wait(fd, "\"return\"") != 0) {
+            warnx("idle: QMP handshake failed");
+            close(fd);
+            return 1;
+        }
+        d->qmp_fd = fd;
+    }
+
+    int len = snprintf(msg, sizeof msg, "{\"execute\":\"%s\"}\n", command);
+    if (write(d->qmp_fd, msg, len) != len ||
+            qmp_wait(d->qmp_fd, "\"return\"") != 0) {
+        warnx("idle: QMP %s failed", command);
+        close(d->qmp_fd);
+        d->qmp_fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns 1 if process 'pid' is stopped, 0 if not.
+ */
+static int process_stopped(pid_t pid)
+{
+    char path[32], buf[256];
+    int fd;
+    ssize_t n;
+
+    snprintf(path, sizeof path, "/proc/%d/stat", (int)pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    n = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    /* The state follows the command name, which may contain anything */
+    char *p = strrchr(buf, ')');
+    return p && p[1] == ' ' && p[2] == 'T';
+}
+
+static int pause_guest(struct idle *d)
+{
+    if (d->qmp_path)
+        return qmp_execute(d, "stop");
+    if (kill(d->pid, SIGSTOP) == -1) {
+        warn("idle: Could not stop guest");
+        return 1;
+    }
+    /* Signal delivery is asynchronous, give it up to 100 ms */
+    for (int i = 0; i < 10; i++) {
+        if (process_stopped(d->pid))
+            return 0;
+        usleep(10000);
+    }
+    warnx("idle: Guest did not stop");
+    kill(d->pid, SIGCONT);
+    return 1;
+}
+
+static int resume_guest(struct idle *d)
+{
+    if (d->qmp_path)
+        return qmp_execute(d, "cont");
+    if (kill(d->pid, SIGCONT) == -1) {
+        warn("idle: Could not continue guest");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Ask the kernel to reclaim as much of our cgroup's memory as it can. This
+ * requires a writable cgroup v2 hierarchy, which Docker does not provide by
+ * default, so failure is not an error.
+ */
+static void reclaim_memory(void)
+{
+    char buf[32];
+    int fd;
+    ssize_t n;
+
+    fd = open("/sys/fs/cgroup/memory.current", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        warn("idle: Could not reclaim memory");
+        return;
+    }
+    n = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (n <= 0)
+        return;
+    buf[n] = '\0';
+
+    fd = open("/sys/fs/cgroup/memory.reclaim", O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        warn("idle: Could not reclaim memory");
+        return;
+    }
+    /* EAGAIN just means less than requested could be reclaimed */
+    if (write(fd, buf, strlen(buf)) == -1 && errno != EAGAIN)
+        warn("idle: Could not reclaim memory");
+    close(fd);
+}
+
+int idle_tick(struct idle *d)
+{
+    if (d->paused)
+        return -1;
+
+    uint64_t packets = read_counter(d->rx_fd) + read_counter(d->tx_fd);
+    if (packets != d->packets || d->t_active.tv_sec == 0) {
+        d->packets = packets;
+        clock_gettime(CLOCK_MONOTONIC, &d->t_active);
+        return IDLE_TICK_MS;
+    }
+    if (elapsed_ms(&d->t_active) < (long)d->timeout * 1000)
+        return IDLE_TICK_MS;
+
+    /*
+     * Start watching for frames before pausing, so that we cannot miss
+     * one.
+     */
+    if (set_filter(d->fd, filter_to_guest,
+                sizeof filter_to_guest / sizeof filter_to_guest[0]) == -1) {
+        warn("idle: Could not attach socket filter");
+        return IDLE_TICK_MS;
+    }
+    if (pause_guest(d) != 0) {
+        set_filter(d->fd, filter_drop,
+                sizeof filter_drop / sizeof filter_drop[0]);
+        clock_gettime(CLOCK_MONOTONIC, &d->t_active);
+        return IDLE_TICK_MS;
+    }
+    d->paused = 1;
+    warnx("idle: Paused guest after %u s without traffic", d->timeout);
+    if (d->reclaim)
+        reclaim_memory();
+
+    return -1;
+}
+
+void idle_wake(struct idle *d)
+{
+    char buf[1];
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof buf };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof control
+    };
+    struct cmsghdr *cmsg;
+    struct timespec t_frame, now;
+
+    if (recvmsg(d->fd, &msg, MSG_DONTWAIT) == -1)
+        return;
+    if (!d->paused)
+        return;
+    clock_gettime(CLOCK_REALTIME, &t_frame);
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            memcpy(&t_frame, CMSG_DATA(cmsg), sizeof t_frame);
+    }
+
+    if (resume_guest(d) != 0)
+        return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    warnx("idle: Resumed guest, wakeup latency %ld us",
+            (long)((now.tv_sec - t_frame.tv_sec) * 1000000 +
+            (now.tv_nsec - t_frame.tv_nsec) / 1000));
+
+    /*
+     * The frame itself is still queued on the tap for the guest. Stop
+     * watching and throw away our copies.
+     */
+    set_filter(d->fd, filter_drop, sizeof filter_drop / sizeof filter_drop[0]);
+    while (recv(d->fd, buf, sizeof buf, MSG_DONTWAIT) != -1)
+        ;
+    d->paused = 0;
+    d->packets = read_counter(d->rx_fd) + read_counter(d->tx_fd);
+    clock_gettime(CLOCK_MONOTONIC, &d->t_active);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2016 Martin Lucina <martin.lucina@docker.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef RUNNER_IDLE_H
+#define RUNNER_IDLE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Idle mode: pause the guest after a period with no traffic on the tap
+ * interface and resume it when a frame for the guest arrives. While the
+ * guest is paused frames stay queued on the tap, so nothing is lost.
+ *
+ * Guests run by QEMU are paused using QMP, all others using SIGSTOP. The
+ * latter does not work if the hypervisor is PID 1, so idle_open() refuses
+ * that configuration.
+ */
+struct idle {
+    /* Configuration, see idle_configure() */
+    unsigned int timeout;
+    int reclaim;
+    const char *qmp_path;
+
+    /* Runtime state */
+    pid_t pid;
+    int fd;
+    int rx_fd, tx_fd;
+    int qmp_fd;
+    int paused;
+    uint64_t packets;
+    struct timespec t_active;
+};
+
+/*
+ * Initialise *d from RUNNER_IDLE* environment variables. Returns 0 if
+ * successful, 1 if the configuration is invalid.
+ */
+int idle_configure(struct idle *d);
+
+/*
+ * Open the resources needed to watch the tap interface 'ifname'. Must be
+ * called before capabilities are dropped, and after d->qmp_path is set if
+ * QMP is to be used. Returns 0 if successful, 1 if not.
+ */
+int idle_open(struct idle *d, const char *ifname, int ifindex);
+
+/*
+ * Check for traffic and pause the guest (process d->pid) if it has been
+ * idle for long enough. Returns the number of milliseconds until the next
+ * check, or -1 if the guest is paused.
+ */
+int idle_tick(struct idle *d);
+
+/*
+ * Called when a frame for the guest arrives on d->fd. Resumes the guest if
+ * it is paused.
+ */
+void idle_wake(struct idle *d);
+
+#endif
@@ -0,0 +1,423 @@
+/*
+ * Copyright (c) 2016 Martin Lucina <martin.lucina@docker.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include <cap-ng.h>
+
+#include "monitor.h"
+
+/* Longest console line considered when matching READY_CONSOLE */
+#define CONSOLE_LINE_MAX 1024
+
+int monitor_configure(struct monitor *m)
+{
+    char *s;
+
+    memset(m, 0, sizeof *m);
+    m->ready = READY_NONE;
+    m->ready_fd = -1;
+    m->pkt_fd = -1;
+    m->console_fd = -1;
+    m->stdout_fd = -1;
+
+    if (capture_configure(&m->capture) != 0)
+        return 1;
+    if (idle_configure(&m->idle) != 0)
+        return 1;
+
+    /*
+     * RUNNER_READY: frame | console:REGEX
+     */
+    s = getenv("RUNNER_READY");
+    if (s == NULL || *s == '\0')
+        return 0;
+    if (strcmp(s, "frame") == 0) {
+        m->ready = READY_FRAME;
+    }
+    else if (strncmp(s, "console:", 8) == 0) {
+        int rc = regcomp(&m->ready_re, s + 8, REG_EXTENDED | REG_NOSUB);
+        if (rc != 0) {
+            char errbuf[128];
+            regerror(rc, &m->ready_re, errbuf, sizeof errbuf);
+            warnx("error: Invalid RUNNER_READY pattern: %s", errbuf);
+            return 1;
+        }
+        m->ready = READY_CONSOLE;
+    }
+    else {
+        warnx("error: Invalid RUNNER_READY: %s", s);
+        return 1;
+    }
+
+    /*
+     * Notification methods. Any combination may be used; with none of them
+     * set the readiness time is only reported on stderr.
+     */
+    s = getenv("RUNNER_READY_FILE");
+    if (s && *s)
+        m->ready_file = s;
+    s = getenv("RUNNER_READY_FD");
+    if (s && *s) {
+        char *end;
+        long fd = strtol(s, &end, 10);
+        if (*end != '\0' || fd < 0 || fcntl(fd, F_GETFD) == -1) {
+            warnx("error: Invalid RUNNER_READY_FD: %s", s);
+            return 1;
+        }
+        /* Don't leak it to the hypervisor */
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        m->ready_fd = fd;
+    }
+    s = getenv("NOTIFY_SOCKET");
+    if (s && *s)
+        m->notify_socket = s;
+
+    return 0;
+}
+
+int monitor_open(struct monitor *m, const char *tap_ifname, int tap_ifindex)
+{
+    if (m->ready == READY_FRAME) {
+        /*
+         * Requires CAP_NET_RAW, which Docker grants by default.
+         */
+        int fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+        if (fd == -1) {
+            warn("error: Could not create packet socket");
+            return 1;
+        }
+        struct sockaddr_ll sll;
+        memset(&sll, 0, sizeof sll);
+        sll.sll_family = AF_PACKET;
+        sll.sll_protocol = htons(ETH_P_ALL);
+        sll.sll_ifindex = tap_ifindex;
+        if (bind(fd, (struct sockaddr *)&sll, sizeof sll) == -1) {
+            warn("error: Could not bind packet socket");
+            close(fd);
+            return 1;
+        }
+        m->pkt_fd = fd;
+    }
+
+    if (idle_open(&m->idle, tap_ifname, tap_ifindex) != 0)
+        return 1;
+    return capture_open(&m->capture, tap_ifindex);
+}
+
+/*
+ * Send a sd_notify(3)-style message to NOTIFY_SOCKET.
+ */
+static void notify_socket_send(const char *path, const char *msg)
+{
+    struct sockaddr_un sun;
+    socklen_t sun_len;
+    size_t path_len = strlen(path);
+    int fd;
+
+    if (path_len >= sizeof sun.sun_path) {
+        warnx("NOTIFY_SOCKET path too long");
+        return;
+    }
+    memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    memcpy(sun.sun_path, path, path_len);
+    /* Leading '@' denotes an abstract socket */
+    if (sun.sun_path[0] == '@')
+        sun.sun_path[0] = '\0';
+    sun_len = offsetof(struct sockaddr_un, sun_path) + path_len;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        warn("Could not create NOTIFY_SOCKET socket");
+        return;
+    }
+    if (sendto(fd, msg, strlen(msg), MSG_NOSIGNAL,
+            (struct sockaddr *)&sun, sun_len) == -1)
+        warn("Could not send to NOTIFY_SOCKET");
+    close(fd);
+}
+
+/*
+ * The guest is ready: report and notify everyone who asked to be told.
+ */
+static void ready(struct monitor *m, const char *what)
+{
+    long ms = elapsed_ms(&m->t_boot);
+    char msg[128];
+
+    warnx("Unikernel ready after %ld ms (%s)", ms, what);
+
+    if (m->ready_file) {
+        int fd = open(m->ready_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+        if (fd == -1) {
+            warn("Could not create %s", m->ready_file);
+        }
+        else {
+            int len = snprintf(msg, sizeof msg, "%ld\n", ms);
+            if (write(fd, msg, len) != len)
+                warn("Could not write %s", m->ready_file);
+            close(fd);
+        }
+    }
+    if (m->ready_fd != -1) {
+        int len = snprintf(msg, sizeof msg, "READY=1\n");
+        if (write(m->ready_fd, msg, len) != len)
+            warn("Could not write to RUNNER_READY_FD");
+        close(m->ready_fd);
+        m->ready_fd = -1;
+    }
+    if (m->notify_socket) {
+        snprintf(msg, sizeof msg, "READY=1\nSTATUS=Unikernel ready after "
+                "%ld ms (%s)", ms, what);
+        notify_socket_send(m->notify_socket, msg);
+    }
+
+    m->ready = READY_NONE;
+}
+
+/*
+ * Drain one frame from the packet socket. Returns 1 if it was sent by the
+ * guest.
+ */
+static int frame_from_guest(int fd)
+{
+    char buf[64];
+    struct sockaddr_ll sll;
+    socklen_t sll_len = sizeof sll;
+
+    ssize_t n = recvfrom(fd, buf, sizeof buf, MSG_TRUNC | MSG_DONTWAIT,
+            (struct sockaddr *)&sll, &sll_len);
+    if (n == -1)
+        return 0;
+    /*
+     * Frames written by the guest are received by the host side of the
+     * tap. Outgoing frames are traffic towards the guest.
+     */
+    return sll.sll_pkttype != PACKET_OUTGOING;
+}
+
+/*
+ * Copy console output through to our real stdout, matching complete lines
+ * against ready_re while we are still waiting. Returns 0 at EOF.
+ */
+static int console_copy(struct monitor *m, char *line, size_t *line_len)
+{
+    char buf[4096];
+    ssize_t n;
+
+    n = read(m->console_fd, buf, sizeof buf);
+    if (n == -1)
+        return errno == EINTR || errno == EAGAIN;
+    if (n == 0)
+        return 0;
+
+    for (ssize_t off = 0; off < n; ) {
+        ssize_t w = write(m->stdout_fd, buf + off, n - off);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        off += w;
+    }
+
+    if (m->ready != READY_CONSOLE)
+        return 1;
+    for (ssize_t i = 0; i < n && m->ready == READY_CONSOLE; i++) {
+        if (buf[i] == '\n') {
+            line[*line_len] = '\0';
+            if (regexec(&m->ready_re, line, 0, NULL, 0) == 0)
+                ready(m, "console");
+            *line_len = 0;
+        }
+        else if (*line_len < CONSOLE_LINE_MAX - 1) {
+            line[(*line_len)++] = buf[i];
+        }
+    }
+    return 1;
+}
+
+static int monitor_run(struct monitor *m)
+{
+    char line[CONSOLE_LINE_MAX];
+    size_t line_len = 0;
+
+    for (;;) {
+        struct pollfd pfd[4];
+        int npfd = 0;
+        int pkt_idx = -1, console_idx = -1, capture_idx = -1, idle_idx = -1;
+        int timeout = -1;
+
+        if (m->pkt_fd != -1) {
+            pfd[npfd].fd = m->pkt_fd;
+            pfd[npfd].events = POLLIN;
+            pkt_idx = npfd++;
+        }
+        if (m->console_fd != -1) {
+            pfd[npfd].fd = m->console_fd;
+            pfd[npfd].events = POLLIN;
+            console_idx = npfd++;
+        }
+        if (m->capture.fd != -1) {
+            pfd[npfd].fd = m->capture.fd;
+            pfd[npfd].events = POLLIN;
+            capture_idx = npfd++;
+        }
+        if (m->idle.fd != -1) {
+            pfd[npfd].fd = m->idle.fd;
+            pfd[npfd].events = POLLIN;
+            idle_idx = npfd++;
+            timeout = idle_tick(&m->idle);
+        }
+        if (npfd == 0)
+            return 0;
+
+        if (poll(pfd, npfd, timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+            warn("poll() failed");
+            return 1;
+        }
+
+        if (pkt_idx != -1 && pfd[pkt_idx].revents) {
+            if (frame_from_guest(m->pkt_fd))
+                ready(m, "frame");
+            if (m->ready != READY_FRAME) {
+                close(m->pkt_fd);
+                m->pkt_fd = -1;
+            }
+        }
+        if (console_idx != -1 && pfd[console_idx].revents) {
+            if (!console_copy(m, line, &line_len)) {
+                /* Hypervisor has exited */
+                return 0;
+            }
+        }
+        if (capture_idx != -1 && pfd[capture_idx].revents) {
+            if (capture_drain(&m->capture) != 0) {
+                warnx("capture: Stopped");
+                close(m->capture.fd);
+                m->capture.fd = -1;
+            }
+        }
+        if (idle_idx != -1 && pfd[idle_idx].revents)
+            idle_wake(&m->idle);
+    }
+}
+
+int monitor_start(struct monitor *m)
+{
+    int console_pipe[2] = { -1, -1 };
+
+    if (m->ready == READY_NONE && m->capture.fd == -1 && m->idle.fd == -1)
+        return 0;
+
+    if (capture_start(&m->capture) != 0)
+        return 1;
+
+    /*
+     * To watch the console we interpose a pipe on the hypervisor's stdout
+     * and copy it through to our own.
+     */
+    if (m->ready == READY_CONSOLE) {
+        if (pipe2(console_pipe, O_CLOEXEC) == -1) {
+            warn("error: pipe2() failed");
+            return 1;
+        }
+        m->stdout_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        if (m->stdout_fd == -1) {
+            warn("error: Could not duplicate stdout");
+            return 1;
+        }
+        m->console_fd = console_pipe[0];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &m->t_boot);
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        warn("error: fork() failed");
+        return 1;
+    }
+
+    if (pid == 0) {
+        /*
+         * Monitor process. Exit along with the hypervisor, and give up any
+         * capabilities we may have left.
+         */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent)
+            _exit(0);
+        capng_clear(CAPNG_SELECT_BOTH);
+        if (capng_apply(CAPNG_SELECT_BOTH) != 0) {
+            warnx("monitor: Could not drop capabilities");
+            _exit(1);
+        }
+        if (console_pipe[1] != -1)
+            close(console_pipe[1]);
+        m->idle.pid = parent;
+        _exit(monitor_run(m));
+    }
+
+    /*
+     * Parent, about to become the hypervisor.
+     */
+    if (m->pkt_fd != -1)
+        close(m->pkt_fd);
+    if (m->capture.fd != -1) {
+        close(m->capture.fd);
+        close(m->capture.out_fd);
+    }
+    if (m->idle.fd != -1) {
+        close(m->idle.fd);
+        close(m->idle.rx_fd);
+        close(m->idle.tx_fd);
+    }
+    if (m->ready_fd != -1)
+        close(m->ready_fd);
+    if (m->ready == READY_CONSOLE) {
+        close(m->stdout_fd);
+        close(m->console_fd);
+        if (dup2(console_pipe[1], STDOUT_FILENO) == -1) {
+            warn("error: Could not redirect stdout");
+            return 1;
+        }
+        close(console_pipe[1]);
+    }
+
+    return 0;
+}
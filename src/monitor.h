@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2016 Martin Lucina <martin.lucina@docker.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef RUNNER_MONITOR_H
+#define RUNNER_MONITOR_H
+
+#include <regex.h>
+#include <time.h>
+
+#include "capture.h"
+#include "idle.h"
+
+/*
+ * The monitor is a process forked off by runner just before it execs the
+ * hypervisor. The hypervisor keeps runner's PID (so signals sent by Docker
+ * reach it directly), the monitor runs alongside it with no capabilities
+ * and watches the guest.
+ */
+
+/* What the monitor considers the guest being "ready" */
+enum ready_signal {
+    READY_NONE,
+    READY_FRAME,        /* First frame sent by the guest on the tap */
+    READY_CONSOLE       /* Console line matching a regular expression */
+};
+
+struct monitor {
+    /* Configuration, see monitor_configure() */
+    enum ready_signal ready;
+    regex_t ready_re;
+    char *ready_file;
+    int ready_fd;
+    char *notify_socket;
+    struct capture capture;
+    struct idle idle;
+
+    /* Runtime state */
+    int pkt_fd;
+    int console_fd;
+    int stdout_fd;
+    struct timespec t_boot;
+};
+
+/*
+ * Milliseconds elapsed on CLOCK_MONOTONIC since *since.
+ */
+static inline long elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 +
+        (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/*
+ * Initialise *m from RUNNER_* environment variables. Returns 0 if
+ * successful, 1 if the configuration is invalid.
+ */
+int monitor_configure(struct monitor *m);
+
+/*
+ * Open any resources the monitor needs which require privileges. Must be
+ * called before capabilities are dropped. Returns 0 if successful, 1 if
+ * not.
+ */
+int monitor_open(struct monitor *m, const char *tap_ifname, int tap_ifindex);
+
+/*
+ * Fork the monitor process. Returns 0 in the parent if successful, 1 if
+ * not. Never returns in the child.
+ */
+int monitor_start(struct monitor *m);
+
+#endif
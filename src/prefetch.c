@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2016 Martin Lucina <martin.lucina@docker.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <assert.h>
+#include <elf.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cap-ng.h>
+
+#include "prefetch.h"
+#include "ptrvec.h"
+
+/* Where to look for shared libraries */
+static const char *lib_dirs[] = {
+    "/lib/x86_64-linux-gnu",
+    "/usr/lib/x86_64-linux-gnu",
+    "/lib64",
+    "/lib",
+    "/usr/lib",
+    "/usr/local/lib",
+    NULL
+};
+
+/* Upper bound on files prefetched, in case of a broken dependency graph */
+#define PREFETCH_MAX 256
+
+/* The prefetch process, if running */
+static pid_t prefetch_pid = -1;
+
+static int seen(ptrvec *pv, const char *path)
+{
+    for (size_t i = 0; i < pv->len; i++) {
+        if (strcmp(pv->p[i], path) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Add the library 'name' to 'pv', unless already present or not found.
+ */
+static void add_lib(ptrvec *pv, const char *name)
+{
+    char *path;
+    int rc;
+
+    if (strchr(name, '/')) {
+        if (!seen(pv, name))
+            pvadd(pv, strdup(name));
+        return;
+    }
+    for (const char **dir = lib_dirs; *dir; dir++) {
+        rc = asprintf(&path, "%s/%s", *dir, name);
+        assert(rc != -1);
+        if (access(path, R_OK) == 0) {
+            if (seen(pv, path))
+                free(path);
+            else
+                pvadd(pv, path);
+            return;
+        }
+        free(path);
+    }
+}
+
+/*
+ * Translate a virtual address in the ELF image to a file offset. Returns
+ * 0 if not found.
+ */
+static Elf64_Off vaddr_to_offset(const Elf64_Phdr *ph, int phnum,
+        Elf64_Addr vaddr)
+{
+    for (int i = 0; i < phnum; i++) {
+        if (ph[i].p_type == PT_LOAD && vaddr >= ph[i].p_vaddr &&
+                vaddr < ph[i].p_vaddr + ph[i].p_filesz)
+            return vaddr - ph[i].p_vaddr + ph[i].p_offset;
+    }
+    return 0;
+}
+
+/*
+ * If the image at 'base' is a dynamically linked ELF64 object, add its
+ * interpreter and needed libraries to 'pv'.
+ */
+static void add_elf_deps(ptrvec *pv, const unsigned char *base, size_t size)
+{
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)base;
+
+    if (size < sizeof *eh || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+            eh->e_ident[EI_CLASS] != ELFCLASS64)
+        return;
+    if (eh->e_phentsize != sizeof(Elf64_Phdr) || eh->e_phoff > size ||
+            eh->e_phnum > (size - eh->e_phoff) / sizeof(Elf64_Phdr))
+        return;
+    const Elf64_Phdr *ph = (const Elf64_Phdr *)(base + eh->e_phoff);
+
+    const Elf64_Dyn *dyn = NULL;
+    size_t dyn_nr = 0;
+    for (int i = 0; i < eh->e_phnum; i++) {
+        if (ph[i].p_offset > size || ph[i].p_filesz > size - ph[i].p_offset)
+            continue;
+        if (ph[i].p_type == PT_INTERP && ph[i].p_filesz > 0 &&
+                base[ph[i].p_offset + ph[i].p_filesz - 1] == '\0') {
+            add_lib(pv, (const char *)base + ph[i].p_offset);
+        }
+        else if (ph[i].p_type == PT_DYNAMIC) {
+            dyn = (const Elf64_Dyn *)(base + ph[i].p_offset);
+            dyn_nr = ph[i].p_filesz / sizeof *dyn;
+        }
+    }
+    if (dyn == NULL)
+        return;
+
+    Elf64_Off strtab = 0;
+    for (size_t i = 0; i < dyn_nr && dyn[i].d_tag != DT_NULL; i++) {
+        if (dyn[i].d_tag == DT_STRTAB)
+            strtab = vaddr_to_offset(ph, eh->e_phnum, dyn[i].d_un.d_ptr);
+    }
+    if (strtab == 0 || strtab >= size)
+        return;
+    for (size_t i = 0; i < dyn_nr && dyn[i].d_tag != DT_NULL; i++) {
+        if (dyn[i].d_tag != DT_NEEDED)
+            continue;
+        Elf64_Off name = strtab + dyn[i].d_un.d_val;
+        if (name >= size || memchr(base + name, '\0', size - name) == NULL)
+            continue;
+        add_lib(pv, (const char *)base + name);
+    }
+}
+
+/*
+ * Read 'path' into the page cache. If 'path' is an ELF object, add its
+ * dependencies to 'pv'.
+ */
+static void prefetch_file(ptrvec *pv, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+    /*
+     * Lazily pulled image layers may not act on the hint, so also read the
+     * file. readahead() only populates the page cache.
+     */
+    readahead(fd, 0, st.st_size);
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base != MAP_FAILED) {
+        add_elf_deps(pv, base, st.st_size);
+        munmap(base, st.st_size);
+    }
+    close(fd);
+}
+
+int prefetch_start(const char **files)
+{
+    ptrvec *pv = pvnew();
+    struct stat st;
+
+    for (; *files; files++) {
+        if (stat(*files, &st) == -1) {
+            warn("error: %s", *files);
+            pvdel(pv);
+            return 1;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            warnx("error: %s: Not a regular file", *files);
+            pvdel(pv);
+            return 1;
+        }
+        pvadd(pv, strdup(*files));
+    }
+
+    /*
+     * Use a process rather than a thread, so that the monitor can later be
+     * forked safely.
+     */
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        /* Not fatal, just slower */
+        warn("Could not start prefetch process");
+        pvdel(pv);
+        return 0;
+    }
+    else if (pid > 0) {
+        prefetch_pid = pid;
+        pvdel(pv);
+        return 0;
+    }
+
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1 || getppid() != parent)
+        _exit(1);
+    capng_clear(CAPNG_SELECT_BOTH);
+    if (capng_apply(CAPNG_SELECT_BOTH) != 0)
+        _exit(1);
+
+    /* pv grows as dependencies are found */
+    for (size_t i = 0; i < pv->len && i < PREFETCH_MAX; i++)
+        prefetch_file(pv, pv->p[i]);
+    _exit(0);
+}
+
+void prefetch_stop(void)
+{
+    if (prefetch_pid == -1)
+        return;
+    if (waitpid(prefetch_pid, NULL, WNOHANG) == 0) {
+        kill(prefetch_pid, SIGKILL);
+        waitpid(prefetch_pid, NULL, 0);
+    }
+    prefetch_pid = -1;
+}
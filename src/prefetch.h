@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2016 Martin Lucina <martin.lucina@docker.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR
+ * IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef RUNNER_PREFETCH_H
+#define RUNNER_PREFETCH_H
+
+/*
+ * Check that all of 'files' (NULL-terminated) exist, then read them into
+ * the page cache from a background process, along with the ELF interpreter
+ * and shared libraries they need, while runner sets up the network.
+ *
+ * Returns 0 if successful, 1 if any of 'files' does not exist.
+ */
+int prefetch_start(const char **files);
+
+/*
+ * Stop the prefetch process if it is still running, and reap it. Call
+ * before exec of the hypervisor, so that it does not inherit the process.
+ */
+void prefetch_stop(void);
+
+#endif
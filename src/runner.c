@@ -16,7 +16,10 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <fcntl.h>
 #include <sys/types.h>
@@ -26,7 +29,9 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <linux/if.h>
+#include <linux/if_ether.h>
 #include <linux/if_tun.h>
+#include <linux/neighbour.h>
 #include <arpa/inet.h>
 
 #include <netlink/netlink.h>
@@ -34,11 +39,17 @@
 #include <netlink/route/addr.h>
 #include <netlink/route/link.h>
 #include <netlink/route/link/bridge.h>
+#include <netlink/route/neighbour.h>
 #include <netlink/route/route.h>
 #include <netlink/route/nexthop.h>
+#include <netlink/route/qdisc.h>
+#include <netlink/route/qdisc/fq_codel.h>
+#include <netlink/route/qdisc/tbf.h>
 
 #include <cap-ng.h>
 
+#include "monitor.h"
+#include "prefetch.h"
 #include "ptrvec.h"
 
 /* Container-side network interface to use */
@@ -47,6 +58,18 @@
 #define BRIDGE_LINK_NAME "br0"
 /* Name of tap interface to create */
 #define TAP_LINK_NAME    "tap0"
+/* Hypervisor binaries */
+#define QEMU_PATH        "/usr/bin/qemu-system-x86_64"
+#define UKVM_PATH        "/unikernel/ukvm"
+/* Guest memory for QEMU, in MB */
+#define QEMU_MEM_MB      512
+/* Bounds for the TCG translation block cache, in MB */
+#define TCG_TB_MIN_MB    32
+#define TCG_TB_MAX_MB    1024
+/* QMP socket for QEMU, used by idle mode */
+#define QMP_SOCKET_PATH  "/tmp/runner-qmp.sock"
+/* TBF shaping: at most 50ms queued */
+#define TBF_LATENCY_US   50000
 /* Buffer size large enough to hold IPv4 adress with CIDR prefix */
 #define AF_INET_BUFSIZE  19
 
@@ -107,6 +130,288 @@ static int create_bridge_link(struct nl_sock *sk, const char *name)
     return 0;
 }
 
+/*
+ * Parse a rate in bits/s from the environment variable 'name', with an
+ * optional k, m or g suffix, and return it in *rate in bytes/s. Returns 0
+ * if successful or 'name' is not set, 1 if the rate is invalid.
+ */
+static int get_env_rate(const char *name, int *rate)
+{
+    char *s, *end;
+    double bits;
+
+    *rate = 0;
+    s = getenv(name);
+    if (s == NULL || *s == '\0')
+        return 0;
+
+    bits = strtod(s, &end);
+    switch (*end) {
+    case 'k':
+        bits *= 1e3;
+        end++;
+        break;
+    case 'm':
+        bits *= 1e6;
+        end++;
+        break;
+    case 'g':
+        bits *= 1e9;
+        end++;
+        break;
+    }
+    if (*end != '\0' || !isfinite(bits) || bits < 8 || bits / 8 > INT_MAX) {
+        warnx("error: Invalid %s: %s", name, s);
+        return 1;
+    }
+    *rate = bits / 8;
+    return 0;
+}
+
+/*
+ * Set up queueing on egress of 'link': fq_codel, optionally behind a TBF
+ * shaping traffic to 'rate' bytes/s. If 'limit' is non-zero, fq_codel will
+ * queue at most 'limit' packets. Returns 0 if successful, libnl error if
+ * not.
+ */
+static int create_qdisc(struct nl_sock *sk, struct rtnl_link *link, int rate,
+        int limit)
+{
+    struct rtnl_qdisc *q;
+    uint32_t parent = TC_H_ROOT;
+    int err;
+
+    if (rate) {
+        q = rtnl_qdisc_alloc();
+        assert(q);
+        rtnl_tc_set_link(TC_CAST(q), link);
+        rtnl_tc_set_parent(TC_CAST(q), TC_H_ROOT);
+        rtnl_tc_set_handle(TC_CAST(q), TC_HANDLE(1, 0));
+        err = rtnl_tc_set_kind(TC_CAST(q), "tbf");
+        assert(err == 0);
+        /*
+         * Burst of 10ms worth of traffic, but at least 2 full frames.
+         */
+        unsigned int mtu = rtnl_link_get_mtu(link);
+        if (mtu == 0)
+            mtu = ETH_DATA_LEN;
+        int bucket = rate / 100;
+        if (bucket < 2 * (int)(mtu + ETH_HLEN))
+            bucket = 2 * (mtu + ETH_HLEN);
+        rtnl_qdisc_tbf_set_rate(q, rate, bucket, 0);
+        err = rtnl_qdisc_tbf_set_limit_by_latency(q, TBF_LATENCY_US);
+        assert(err == 0);
+
+        err = rtnl_qdisc_add(sk, q, NLM_F_CREATE | NLM_F_REPLACE);
+        rtnl_qdisc_put(q);
+        if (err < 0)
+            return err;
+        parent = TC_HANDLE(1, 1);
+    }
+
+    q = rtnl_qdisc_alloc();
+    assert(q);
+    rtnl_tc_set_link(TC_CAST(q), link);
+    rtnl_tc_set_parent(TC_CAST(q), parent);
+    err = rtnl_tc_set_kind(TC_CAST(q), "fq_codel");
+    assert(err == 0);
+    if (limit)
+        rtnl_qdisc_fq_codel_set_limit(q, limit);
+
+    err = rtnl_qdisc_add(sk, q, NLM_F_CREATE | NLM_F_REPLACE);
+    rtnl_qdisc_put(q);
+    return err;
+}
+
+/*
+ * Read a single unsigned number from 'path'. Returns 0 if not available.
+ */
+static unsigned long long read_ull(const char *path)
+{
+    char buf[32];
+    unsigned long long val = 0;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL)
+        return 0;
+    if (fgets(buf, sizeof buf, f))
+        val = strtoull(buf, NULL, 10);
+    fclose(f);
+    return val;
+}
+
+/*
+ * Determine a size for the TCG translation block cache, in MB, from the
+ * memory available to us after the guest's share. Returns 0 if this
+ * cannot be determined, leaving it to QEMU.
+ */
+static unsigned long get_tcg_tb_size(void)
+{
+    unsigned long long avail = 0, limit;
+    char line[128];
+    FILE *f;
+
+    f = fopen("/proc/meminfo", "r");
+    if (f == NULL)
+        return 0;
+    while (fgets(line, sizeof line, f)) {
+        if (sscanf(line, "MemAvailable: %llu kB", &avail) == 1) {
+            avail *= 1024;
+            break;
+        }
+    }
+    fclose(f);
+    if (avail == 0)
+        return 0;
+
+    /* Container memory limit (cgroup v2, then v1), if lower */
+    limit = read_ull("/sys/fs/cgroup/memory.max");
+    if (limit == 0)
+        limit = read_ull("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+    if (limit && limit < avail)
+        avail = limit;
+
+    avail >>= 20;
+    if (avail <= QEMU_MEM_MB)
+        return TCG_TB_MIN_MB;
+    avail = (avail - QEMU_MEM_MB) / 4;
+    if (avail < TCG_TB_MIN_MB)
+        return TCG_TB_MIN_MB;
+    if (avail > TCG_TB_MAX_MB)
+        return TCG_TB_MAX_MB;
+    return avail;
+}
+
+/*
+ * Bridge attributes to set on the bridge we create. Spanning tree,
+ * multicast snooping and netfilter calls are of no use on a two-port
+ * bridge and only cost time per frame.
+ *
+ * XXX Attribute numbers are IFLA_BR_* from linux/if_link.h, which is too
+ * old on some build images to have them.
+ */
+static const struct bridge_attr {
+    const char *name;
+    int type;
+    int size;
+    uint32_t value;
+} bridge_attrs[] = {
+    { "stp_state",          5, 4, 0 },
+    { "forward_delay",      1, 4, 0 },
+    { "mcast_snooping",    23, 1, 0 },
+    { "nf_call_iptables",  36, 1, 0 },
+    { "nf_call_ip6tables", 37, 1, 0 },
+    { "nf_call_arptables", 38, 1, 0 },
+    { NULL }
+};
+
+/*
+ * Set the bridge attribute 'attr' on the bridge 'ifindex'. Returns 0 if
+ * successful, libnl error if not.
+ */
+static int set_bridge_attr(struct nl_sock *sk, int ifindex,
+        const struct bridge_attr *attr)
+{
+    struct ifinfomsg ifi = {
+        .ifi_family = AF_UNSPEC,
+        .ifi_index = ifindex
+    };
+    struct nl_msg *msg;
+    struct nlattr *info, *data;
+
+    msg = nlmsg_alloc_simple(RTM_NEWLINK, 0);
+    assert(msg);
+    if (nlmsg_append(msg, &ifi, sizeof ifi, NLMSG_ALIGNTO) < 0)
+        goto nla_put_failure;
+    if (!(info = nla_nest_start(msg, IFLA_LINKINFO)))
+        goto nla_put_failure;
+    NLA_PUT_STRING(msg, IFLA_INFO_KIND, "bridge");
+    if (!(data = nla_nest_start(msg, IFLA_INFO_DATA)))
+        goto nla_put_failure;
+    if (attr->size == 1)
+        NLA_PUT_U8(msg, attr->type, attr->value);
+    else
+        NLA_PUT_U32(msg, attr->type, attr->value);
+    nla_nest_end(msg, data);
+    nla_nest_end(msg, info);
+
+    /* Frees msg */
+    return nl_send_sync(sk, msg);
+
+nla_put_failure:
+    nlmsg_free(msg);
+    return -NLE_MSGSIZE;
+}
+
+/*
+ * Configure the bridge 'link' for forwarding between two ports as cheaply
+ * as possible. Failure to set any attribute is reported, but not fatal.
+ */
+static void configure_bridge_link(struct nl_sock *sk, struct rtnl_link *link)
+{
+    static const char *nf_sysctls[] = {
+        "/proc/sys/net/bridge/bridge-nf-call-iptables",
+        "/proc/sys/net/bridge/bridge-nf-call-ip6tables",
+        "/proc/sys/net/bridge/bridge-nf-call-arptables",
+        NULL
+    };
+    const struct bridge_attr *attr;
+    int err;
+
+    for (attr = bridge_attrs; attr->name; attr++) {
+        err = set_bridge_attr(sk, rtnl_link_get_ifindex(link), attr);
+        if (err < 0)
+            warnx("warning: Could not set %s on %s: %s", attr->name,
+                    BRIDGE_LINK_NAME, nl_geterror(err));
+    }
+
+    /*
+     * With br_netfilter loaded, these per-namespace settings apply in
+     * addition to the bridge's own. They only exist if it is loaded, and
+     * Docker mounts /proc/sys read-only unless the container is
+     * privileged, so neither case is worth a warning.
+     */
+    for (const char **path = nf_sysctls; *path; path++) {
+        int fd = open(*path, O_WRONLY);
+        if (fd == -1) {
+            if (errno != ENOENT && errno != EROFS)
+                warn("warning: Could not open %s", *path);
+            continue;
+        }
+        if (write(fd, "0\n", 2) != 2)
+            warn("warning: Could not write %s", *path);
+        close(fd);
+    }
+}
+
+/*
+ * Add a static FDB entry for 'mac' on the bridge port 'port'. Returns 0 if
+ * successful, libnl error if not.
+ */
+static int add_bridge_fdb(struct nl_sock *sk, struct rtnl_link *port,
+        const char *mac)
+{
+    struct rtnl_neigh *neigh;
+    struct nl_addr *lladdr;
+    int err;
+
+    err = nl_addr_parse(mac, AF_LLC, &lladdr);
+    if (err < 0)
+        return err;
+    neigh = rtnl_neigh_alloc();
+    assert(neigh);
+    rtnl_neigh_set_family(neigh, AF_BRIDGE);
+    rtnl_neigh_set_ifindex(neigh, rtnl_link_get_ifindex(port));
+    rtnl_neigh_set_lladdr(neigh, lladdr);
+    rtnl_neigh_set_state(neigh, NUD_NOARP);
+    rtnl_neigh_set_flags(neigh, NTF_MASTER);
+
+    err = rtnl_neigh_add(sk, neigh, NLM_F_CREATE);
+    rtnl_neigh_put(neigh);
+    nl_addr_put(lladdr);
+    return err;
+}
+
 static void match_first_addr(struct nl_object *obj, void *arg)
 {
     static int found = 0;
@@ -279,6 +584,65 @@ int main(int argc, char *argv[])
     argv += 3;
     argc -= 3;
 
+    /*
+     * Get the unikernel and hypervisor into the page cache while we set up
+     * the network. This also fails early if either is missing.
+     */
+    const char *prefetch_files[] = { unikernel, NULL, NULL };
+    if (hypervisor == QEMU || hypervisor == KVM)
+        prefetch_files[1] = QEMU_PATH;
+    else if (hypervisor == UKVM)
+        prefetch_files[1] = UKVM_PATH;
+    if (prefetch_start(prefetch_files) != 0)
+        return 1;
+
+    /*
+     * Optional readiness monitoring, packet capture and idle mode,
+     * configured from the environment.
+     */
+    struct monitor monitor;
+    if (monitor_configure(&monitor) != 0)
+        return 1;
+
+    /*
+     * Number of vCPUs (QEMU, KVM) and software emulation performance
+     * profile.
+     */
+    int cpus = 1;
+    char *cpus_env = getenv("RUNNER_CPUS");
+    if (cpus_env && *cpus_env) {
+        char *end;
+        cpus = strtol(cpus_env, &end, 10);
+        if (*end != '\0' || cpus < 1 || cpus > 255) {
+            warnx("error: Invalid RUNNER_CPUS: %s", cpus_env);
+            return 1;
+        }
+    }
+    char *tcg_env = getenv("RUNNER_TCG_PROFILE");
+    int tcg_profile = (tcg_env && strcmp(tcg_env, "1") == 0);
+
+    /*
+     * Optional traffic control. Rates are from the point of view of the
+     * guest.
+     */
+    int tc_enabled = 0, rate_in, rate_out, tc_limit = 0;
+    if (get_env_rate("RUNNER_RATE_IN", &rate_in) != 0 ||
+            get_env_rate("RUNNER_RATE_OUT", &rate_out) != 0)
+        return 1;
+    char *tc_env = getenv("RUNNER_TC_LIMIT");
+    if (tc_env && *tc_env) {
+        char *end;
+        tc_limit = strtol(tc_env, &end, 10);
+        if (*end != '\0' || tc_limit <= 0) {
+            warnx("error: Invalid RUNNER_TC_LIMIT: %s", tc_env);
+            return 1;
+        }
+    }
+    tc_env = getenv("RUNNER_TC");
+    if ((tc_env && strcmp(tc_env, "1") == 0) || rate_in || rate_out ||
+            tc_limit)
+        tc_enabled = 1;
+
     /*
      * Check we have CAP_NET_ADMIN.
      */
@@ -370,6 +734,7 @@ int main(int argc, char *argv[])
         warnx("error: Could not get link information for %s", BRIDGE_LINK_NAME);
         return 1;
     }
+    configure_bridge_link(sk, l_bridge);
     struct rtnl_link *l_tap;
     l_tap = rtnl_link_get_by_name(link_cache, TAP_LINK_NAME);
     if (l_tap == NULL) {
@@ -389,6 +754,20 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    /*
+     * For QEMU/KVM we choose the guest MAC address, so the bridge need not
+     * learn it.
+     */
+    char *guest_mac = NULL;
+    if (hypervisor == QEMU || hypervisor == KVM) {
+        guest_mac = generate_mac();
+        assert(guest_mac);
+        err = add_bridge_fdb(sk, l_tap, guest_mac);
+        if (err < 0)
+            warnx("warning: Could not add FDB entry for %s on %s: %s",
+                    guest_mac, TAP_LINK_NAME, nl_geterror(err));
+    }
+
     /*
      * Flush all IPv4 addresses from the veth interface. This is now safe
      * as we are good to commit and have retrieved the existing configuration.
@@ -429,6 +808,25 @@ int main(int argc, char *argv[])
     }
     rtnl_link_put(l_up);
 
+    /*
+     * Set up traffic control. Traffic towards the guest leaves via the tap
+     * interface, traffic from the guest via the veth interface.
+     */
+    if (tc_enabled) {
+        err = create_qdisc(sk, l_tap, rate_in, tc_limit);
+        if (err < 0) {
+            warnx("error: Could not set up qdisc on %s: %s", TAP_LINK_NAME,
+                    nl_geterror(err));
+            return 1;
+        }
+        err = create_qdisc(sk, l_veth, rate_out, tc_limit);
+        if (err < 0) {
+            warnx("error: Could not set up qdisc on %s: %s", VETH_LINK_NAME,
+                    nl_geterror(err));
+            return 1;
+        }
+    }
+
     /*
      * Collect network configuration data.
      */
@@ -459,7 +857,7 @@ int main(int argc, char *argv[])
      * /usr/bin/qemu-system-x86_64 <qemu args> -kernel <unikernel> -append "<unikernel args>"
      */
     if (hypervisor == QEMU || hypervisor == KVM) {
-        pvadd(uargpv, "/usr/bin/qemu-system-x86_64");
+        pvadd(uargpv, QEMU_PATH);
         pvadd(uargpv, "-nodefaults");
         pvadd(uargpv, "-no-acpi");
         pvadd(uargpv, "-display");
@@ -467,12 +865,43 @@ int main(int argc, char *argv[])
         pvadd(uargpv, "-serial");
         pvadd(uargpv, "stdio");
         pvadd(uargpv, "-m");
-        pvadd(uargpv, "512");
+        err = asprintf(&uarg_buf, "%d", QEMU_MEM_MB);
+        assert(err != -1);
+        pvadd(uargpv, uarg_buf);
+        if (cpus > 1) {
+            pvadd(uargpv, "-smp");
+            err = asprintf(&uarg_buf, "%d", cpus);
+            assert(err != -1);
+            pvadd(uargpv, uarg_buf);
+        }
         if (hypervisor == KVM) {
             pvadd(uargpv, "-enable-kvm");
             pvadd(uargpv, "-cpu");
             pvadd(uargpv, "host");
         }
+        else if (tcg_profile) {
+            /*
+             * Performance profile for software emulation: one TCG thread
+             * per vCPU and a translation block cache sized to the memory
+             * we have. Requires QEMU 5.0 or later.
+             */
+            unsigned long tb_size = get_tcg_tb_size();
+            pvadd(uargpv, "-accel");
+            if (tb_size)
+                err = asprintf(&uarg_buf, "tcg,thread=%s,tb-size=%lu",
+                        (cpus > 1) ? "multi" : "single", tb_size);
+            else
+                err = asprintf(&uarg_buf, "tcg,thread=%s",
+                        (cpus > 1) ? "multi" : "single");
+            assert(err != -1);
+            pvadd(uargpv, uarg_buf);
+            /*
+             * The smallest CPU model that still has what Mirage needs for
+             * AESNI: every extra feature is more for TCG to emulate.
+             */
+            pvadd(uargpv, "-cpu");
+            pvadd(uargpv, "qemu64,+ssse3,+aes,+pclmulqdq");
+        }
         else {
             /*
              * Required for AESNI use in Mirage.
@@ -480,9 +909,18 @@ int main(int argc, char *argv[])
             pvadd(uargpv, "-cpu");
             pvadd(uargpv, "Westmere");
         }
+        /*
+         * Idle mode pauses QEMU guests using QMP.
+         */
+        if (monitor.idle.timeout) {
+            pvadd(uargpv, "-qmp");
+            err = asprintf(&uarg_buf, "unix:%s,server,nowait",
+                    QMP_SOCKET_PATH);
+            assert(err != -1);
+            pvadd(uargpv, uarg_buf);
+            monitor.idle.qmp_path = QMP_SOCKET_PATH;
+        }
         pvadd(uargpv, "-device");
-        char *guest_mac = generate_mac();
-        assert(guest_mac);
         err = asprintf(&uarg_buf, "virtio-net-pci,netdev=n0,mac=%s", guest_mac);
         assert(err != -1);
         pvadd(uargpv, uarg_buf);
@@ -524,7 +962,7 @@ int main(int argc, char *argv[])
      * /unikernel/ukvm <ukvm args> <unikernel> -- <unikernel args>
      */
     else if (hypervisor == UKVM) {
-        pvadd(uargpv, "/unikernel/ukvm");
+        pvadd(uargpv, UKVM_PATH);
         err = asprintf(&uarg_buf, "--net=@%d", tap_fd);
         assert(err != -1);
         pvadd(uargpv, uarg_buf);
@@ -561,6 +999,13 @@ int main(int argc, char *argv[])
     }
     char **uargv = (char **)pvfinal(uargpv);
 
+    /*
+     * Open monitor resources while we still have privileges.
+     */
+    if (monitor_open(&monitor, TAP_LINK_NAME,
+                rtnl_link_get_ifindex(l_tap)) != 0)
+        return 1;
+
     /*
      * Done with netlink, free all resources and close socket.
      */
@@ -586,6 +1031,17 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    /*
+     * Anything not yet prefetched will be read by the hypervisor itself.
+     */
+    prefetch_stop();
+
+    /*
+     * Fork the monitor, if any.
+     */
+    if (monitor_start(&monitor) != 0)
+        return 1;
+
     /*
      * Run the unikernel.
      */
@@ -0,0 +1,83 @@
+#!/bin/sh
+# Compare requests per second of the 'stackv4' sample under software
+# emulation with the default settings and the TCG performance profile.
+# The profile requires QEMU 5.0 or later in mir-runner-qemu.
+#
+# Each request is a TCP connection sending "Hello". CONCURRENCY clients
+# run for DURATION seconds.
+set -e
+CONCURRENCY=${CONCURRENCY:-16}
+DURATION=${DURATION:-10}
+NAME=bench-mir-stackv4-qemu
+
+trap 'docker rm -f ${NAME} >/dev/null 2>&1 || true' EXIT
+
+load()
+{
+    python3 - "$1" 8080 ${CONCURRENCY} ${DURATION} <<'EOF'
+import socket, sys, threading, time
+
+host, port = sys.argv[1], int(sys.argv[2])
+concurrency, duration = int(sys.argv[3]), float(sys.argv[4])
+done = [0] * concurrency
+failed = [0] * concurrency
+end = time.monotonic() + duration
+
+def client(i):
+    while time.monotonic() < end:
+        try:
+            s = socket.create_connection((host, port), timeout=5)
+            s.sendall(b"Hello")
+            s.close()
+            done[i] += 1
+        except OSError:
+            failed[i] += 1
+
+threads = [threading.Thread(target=client, args=(i,))
+           for i in range(concurrency)]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+if sum(failed):
+    sys.exit("error: %d of %d requests failed" %
+             (sum(failed), sum(done) + sum(failed)))
+print(int(sum(done) / duration))
+EOF
+}
+
+bench()
+{
+    docker run -d --name ${NAME} \
+        --device=/dev/net/tun:/dev/net/tun \
+        --cap-add=NET_ADMIN "$@" mir-stackv4-qemu >/dev/null || return 1
+    IP=$(docker inspect --format "{{ .NetworkSettings.IPAddress }}" ${NAME})
+    # Wait for the unikernel to come up.
+    TRIES=60
+    until echo -n Hello | nc -w 1 ${IP} 8080 >/dev/null 2>&1; do
+        TRIES=$((TRIES - 1))
+        if [ ${TRIES} -eq 0 ]; then
+            echo error: Unikernel did not come up. 1>&2
+            docker logs ${NAME} 2>&1 | tail -10 1>&2
+            return 1
+        fi
+        sleep 1
+    done
+    load ${IP} || return 1
+    docker rm -f ${NAME} >/dev/null
+}
+
+row()
+{
+    LABEL=$1
+    shift
+    RESULT=$(bench "$@")
+    printf "%-40s %s\n" "${LABEL}" "${RESULT}"
+}
+
+command -v python3 >/dev/null || { echo error: python3 required. 1>&2; exit 1; }
+printf "%-40s %s\n" SETTINGS REQ/S
+row "default"
+row "RUNNER_TCG_PROFILE=1" -e RUNNER_TCG_PROFILE=1
+row "RUNNER_TCG_PROFILE=1 RUNNER_CPUS=2" \
+    -e RUNNER_TCG_PROFILE=1 -e RUNNER_CPUS=2
@@ -2,10 +2,45 @@
 set -ex
 docker run -d --name test-mir-stackv4-qemu \
     --device=/dev/net/tun:/dev/net/tun \
-    --cap-add=NET_ADMIN mir-stackv4-qemu
+    --cap-add=NET_ADMIN \
+    -e RUNNER_READY=frame -e RUNNER_READY_FILE=/tmp/ready \
+    -e RUNNER_CAPTURE=/tmp \
+    -e RUNNER_IDLE=2 \
+    -e RUNNER_RATE_IN=10m \
+    mir-stackv4-qemu
 IP=$(docker inspect --format "{{ .NetworkSettings.IPAddress }}" test-mir-stackv4-qemu)
+for i in $(seq 30); do
+    docker logs test-mir-stackv4-qemu 2>&1 | grep -q "Unikernel ready after" \
+        && break
+    sleep 1
+done
+docker logs test-mir-stackv4-qemu 2>&1 | grep "Unikernel ready after"
+docker exec test-mir-stackv4-qemu test -f /tmp/ready
+# Bridge configuration must have succeeded, and the guest's MAC address
+# must be a static FDB entry on the tap. The runtime image has no
+# iproute2, so look from a helper container.
+if docker logs test-mir-stackv4-qemu 2>&1 | grep "warning: Could not"; then
+    exit 1
+fi
+docker run --rm --net container:test-mir-stackv4-qemu mir-test-iproute2 \
+    bridge fdb show dev tap0 | grep "master br0 static"
 echo -n Hello | nc ${IP} 8080
+# The capture must contain frames, not just the pcap file header (24
+# bytes). Blocks are handed over after at most 100ms.
+sleep 1
+test $(docker exec test-mir-stackv4-qemu stat -c %s /tmp/capture.pcap) -gt 24
+# Idle mode: wait for the guest to be paused, then wake it with a request.
+last_idle()
+{
+    docker logs test-mir-stackv4-qemu 2>&1 | grep "idle:" | tail -1
+}
+for i in $(seq 30); do
+    last_idle | grep -q "idle: Paused guest" && break
+    sleep 1
+done
+last_idle | grep "idle: Paused guest"
+echo -n Hello | nc ${IP} 8080
+last_idle | grep "idle: Resumed guest"
 docker logs test-mir-stackv4-qemu | tail -10
 docker kill test-mir-stackv4-qemu
 docker rm test-mir-stackv4-qemu
-
@@ -10,6 +10,10 @@ docker run -d --name test-mir-stackv4-ukvm \
     --cap-add=NET_ADMIN mir-stackv4-ukvm
 IP=$(docker inspect --format "{{ .NetworkSettings.IPAddress }}" test-mir-stackv4-ukvm)
 echo -n Hello | nc ${IP} 8080
+# Bridge configuration must have succeeded.
+if docker logs test-mir-stackv4-ukvm 2>&1 | grep "warning: Could not"; then
+    exit 1
+fi
 docker logs test-mir-stackv4-ukvm | tail -10
 docker kill test-mir-stackv4-ukvm
 docker rm test-mir-stackv4-ukvm